@@ -56,6 +56,12 @@ extern "C" {
 #define DEFAULT_MAX_RETRY		3600	// retry at least this often
 #define DEFAULT_MAX_TTL			60	// packets expire after this many seconds
 #define DEFAULT_MAX_QUEUE		512	// never queue more than this many packets
+#define DEFAULT_MAX_QUEUE_BYTES		(256 * 1024) // never queue more than this many bytes
+#define DEFAULT_CODEL_TARGET		.005	// acceptable standing queue delay
+#define DEFAULT_CODEL_INTERVAL		.1	// worst-case rtt the queue has to absorb
+
+#define MAX_NODE_ID			0xfffff	// node ids are 20 bits wide on the wire
+#define MAX_TCP_STREAMS			8	// parallel tcp connections per node
 
 #define DEFAULT_DNS_TIMEOUT_FACTOR	8.F	// initial retry timeout multiple
 #define DEFAULT_DNS_SEND_INTERVAL	.01F	// minimum send interval
@@ -81,7 +87,7 @@ const char *strprotocol (u8 protocol);
 
 struct conf_node
 {
-  int id;         // the id of this node, a 12-bit-number
+  int id;         // the id of this node, a 20-bit-number, see MAX_NODE_ID
 
   RSA *rsa_key;   // his public key
   char *nodename; // nodename, an internal nickname.
@@ -98,6 +104,7 @@ struct conf_node
   int max_retry;
   double max_ttl;   // packets expire after this many seconds
   int max_queue;    // maixmum send queue length
+  u32 max_queue_bytes; // maximum send queue size in bytes
 
   enum connectmode { C_ONDEMAND, C_NEVER, C_ALWAYS, C_DISABLED } connectmode;
   bool compress;
@@ -106,6 +113,12 @@ struct conf_node
   vector<const char *> allow_direct;
   vector<const char *> deny_direct;
 
+  // allow_direct/deny_direct compiled by finalise: bit id-1 is set when
+  // we may connect directly to node id. nodes that treat all other
+  // nodes the same (the common case) have no map, just direct_all.
+  u32 *direct_map;
+  bool direct_all;
+
   u32 routerprio;
 
   u8 connectable_protocols () const
@@ -120,8 +133,21 @@ struct conf_node
     return protocols;
   }
 
-  bool may_direct (struct conf_node *other);
-  void finalise ();
+  bool may_direct (const conf_node *other) const
+  {
+    if (!direct_map)
+      return direct_all;
+
+    int bit = other->id - 1;
+    return direct_map [bit >> 5] & (1U << (bit & 31));
+  }
+
+  // byname: the same nodes, sorted by nodename
+  void finalise (const vector<conf_node *> &nodes, const vector<conf_node *> &byname);
+
+  // true if a connection to o can be kept when o is replaced by this
+  // node on a configuration reload
+  bool same_peer (const conf_node &o) const;
 
   void print ();
 
@@ -140,8 +166,11 @@ struct configuration
   int nfmark;       // the SO_MARK // netfilter mark // fwmark
   double rekey;     // rekey interval
   double keepalive; // keepalive probes interval
+  double codel_target;   // codel target queue delay
+  double codel_interval; // codel interval
   char *ifname;     // the interface name (tap0 ...)
   bool ifpersist;   // should the interface be persistent
+  bool multipath;   // spread traffic over all working paths to a node
   char *prikeyfile;
   RSA *rsa_key;     // our private rsa key
   loglevel llevel;
@@ -159,10 +188,15 @@ struct configuration
   char *script_node_down;
   char *pidfilename;
 
+#if ENABLE_TCP
+  int tcp_streams;	// number of parallel tcp connections to each node
+#endif
+
 #if ENABLE_HTTP_PROXY
   char *proxy_auth;	// login:password
   char *proxy_host;	// the proxy hostname, e.g. proxy1.example.net
   u16 proxy_port;	// the proxy port, e.g. 3128
+  int proxy_prewarm;	// keep this many tunnels to nodes open
 #endif
 
 #if ENABLE_DNS
@@ -194,13 +228,18 @@ struct configuration_parser
   configuration &conf;
 
   bool need_keys;
+  bool fatal; // exit on errors, otherwise only clear ok
+  bool ok;
   conf_node *node;
 
+  // a copy, as parse_argv consumes the options it applies
   int argc;
   char **argv;
 
-  configuration_parser (configuration &conf, bool need_keys, int argc, char **argv);
+  configuration_parser (configuration &conf, bool need_keys, int argc, char **argv, bool fatal = true);
+  ~configuration_parser ();
 
+  void fail ();
   void parse_file (const char *fname);
   const char *parse_line (char *line);
   void parse_argv ();
@@ -32,6 +32,8 @@
 #ifndef GVPE_CONNECTION_H__
 #define GVPE_CONNECTION_H__
 
+#include <deque>
+
 #include <openssl/hmac.h>
 
 #include "global.h"
@@ -66,9 +68,8 @@ struct hmac_packet : net_packet
   bool hmac_chk (crypto_ctx * ctx);
 
 private:
-  static unsigned char hmac_digest[EVP_MAX_MD_SIZE];
-
-  void hmac_gen (crypto_ctx * ctx);
+  // thread-safe as long as nobody else uses ctx at the same time
+  void hmac_gen (crypto_ctx * ctx, unsigned char *digest);
 };
 
 struct vpn_packet : hmac_packet
@@ -84,7 +85,14 @@ struct vpn_packet : hmac_packet
     PT_CONNECT_REQ,	// want other node to contact me
     PT_CONNECT_INFO,	// request connection to some node
     PT_DATA_BRIDGED,    // uncompressed packet with foreign mac pot. larger than path mtu (NYI)
-    PT_MAX
+    PT_LINKSTATE,       // link-state advertisement, only sent to FEATURE_LINKSTATE nodes
+    PT_MAX,
+
+    // set in the type byte when src or dst do not fit into 12 bits. such
+    // packets carry a two-byte trailer with id bits 12..19 of src and dst,
+    // which is appended by vpn::send_vpn_packet and removed again by
+    // vpn::recv_vpn_packet, so the rest of the code never sees it.
+    PT_EXTENDED = 0x80
   };
 
   u8 type;
@@ -94,57 +102,174 @@ struct vpn_packet : hmac_packet
 
   unsigned int src () const
   {
-    return src1 | ((srcdst >> 4) << 8);
+    return src1 | ((srcdst >> 4) << 8) | (src2 << 12);
   }
 
   unsigned int dst () const
   {
-    return dst1 | ((srcdst & 0xf) << 8);
+    return dst1 | ((srcdst & 0xf) << 8) | (dst2 << 12);
   }
 
   ptype typ () const
   {
-    return (ptype) type;
+    return (ptype) (type & ~PT_EXTENDED);
+  }
+
+  bool extended () const
+  {
+    return type & PT_EXTENDED;
+  }
+
+  void add_trailer ()
+  {
+    (*this)[len++] = src2;
+    (*this)[len++] = dst2;
+  }
+
+  bool remove_trailer ()
+  {
+    if (len < sizeof (vpn_packet) - sizeof (net_packet) + 2)
+      return false;
+
+    dst2 = (*this)[--len];
+    src2 = (*this)[--len];
+
+    return true;
   }
 };
 
 ////////////////////////////////////////////////////////////////////////////////////////
 
-/* a very simple fifo pkt-queue */
+/* a flow-queued pkt-queue with codel-style active queue management.
+ * packets are sorted into priority bands by their (inner) tos. the
+ * interactive band is always served first, the normal and bulk bands
+ * share the remaining capacity by weight. within a band, packets are
+ * hashed by flow into a few sub-queues that are served round-robin by
+ * bytes, so a single bulk flow cannot starve the others.
+ * on dequeue, packets get dropped while they have been waiting longer
+ * than target for more than interval, which keeps standing queues short.
+ * in addition, the queue is bounded by packets, bytes and age.
+ * the queue owns one reference to each queued packet, get () hands
+ * that reference to the caller. */
 class pkt_queue
 {
-  int i, j;
+  enum { FLOWS = 8 };
+
   int max_queue;
+  u32 max_bytes;
   double max_ttl;
 
   struct pkt {
     ev_tstamp tstamp;
     net_packet *pkt;
-  } *queue;
+  };
+
+  struct flow {
+    std::deque<pkt> q;
+    u32 bytes;
+    int deficit;
+
+    // codel state
+    ev_tstamp first_above, drop_next;
+    u32 drop_count;
+    bool dropping;
+  };
+
+  struct band {
+    flow flows[FLOWS];
+    int cur; // current flow in round-robin order
+    int count;
+    int deficit;
+  };
+
+  // the bands are only allocated while packets are queued (and for
+  // a while after), most queues of a large mesh are empty all the time
+  band *bands;
+
+  int cur; // current weighted band
+  int count;
+  u32 bytes;
+
+  void drop (band &b, flow &f);
+  net_packet *pop (band &b, flow &f, ev_tstamp now, bool &ok_to_drop);
+  net_packet *codel_get (band &b, flow &f);
+  net_packet *band_get (band &b);
+  void alloc_bands ();
+  void free_bands ();
 
   void expire_cb (ev::timer &w, int revents); ev::timer expire;
 
 public:
+  double target, interval; // codel parameters
+  u32 drops; // number of packets dropped so far
 
-  void put (net_packet *p);
+  // hash identifies the flow, prio is one of PRIO_*
+  void put (net_packet *p, u32 hash = 0, int prio = PRIO_NORMAL);
   net_packet *get ();
 
   bool empty ()
   {
-    return i == j;
+    return !count;
+  }
+
+  int size ()
+  {
+    return count;
   }
 
-  pkt_queue (double max_ttl, int max_queue);
+  pkt_queue (double max_ttl, int max_queue, u32 max_bytes);
   ~pkt_queue ();
 };
 
+#define LINKSTATE_MAX_LINKS 192 // links per packet, keeps it below common mtus
+#define LINKSTATE_MAX_SIG   512 // bytes, enough for 4096 bit keys
+#define LINKSTATE_COST_BITS 12  // the rest of a link is the (20 bit) node id
+
+/* (part of) a link-state advertisement: the nodes origin has established
+ * direct connections to, and what it costs to use them (rtt in ms).
+ * routers flood these, so every node can compute multi-hop routes.
+ * every packet is signed by origin, as any router can flood it.
+ * all fields are in network byte order. */
+struct linkstate_packet : vpn_packet
+{
+  u32 origin, total;  // total == number of links of origin
+  u32 offset, count;  // this packet carries links [offset, offset + count)
+  u32 seqno;          // newer advertisements replace older ones
+  u32 siglen;         // origin's signature directly follows the links
+  u32 link[LINKSTATE_MAX_LINKS + LINKSTATE_MAX_SIG / 4]; // node id << LINKSTATE_COST_BITS | cost
+
+  u8 *sig () const { return (u8 *)(link + ntohl (count)); }
+
+  void setup (int dst, int origin, int total, int offset, int count, u32 seqno);
+  bool valid () const;
+
+  void digest (u8 *h) const;
+  void sign (RSA *key);
+  bool verify (RSA *key) const;
+};
+
 enum
 {
   FEATURE_COMPRESSION = 0x01,
   FEATURE_ROHC        = 0x02,
-  FEATURE_BRIDGING    = 0x04
+  FEATURE_BRIDGING    = 0x04,
+  FEATURE_LINKSTATE   = 0x08,
+  FEATURE_PING_STAMP  = 0x10  // echoes ping stamps, required for mtu probes
 };
 
+#define MAX_PATHS           8                      // maximum number of paths per connection
+#define PATH_PROBE_INTERVAL (::conf.keepalive * .25) // probe all paths this often
+#define PATH_TIMEOUT        (::conf.keepalive * .5)  // dead without an answer for this long
+
+#define MIN_PATH_MTU        576   // every ipv4 path must be able to do that
+#define MTU_PROBE_TRIES     3     // a probe size fails after this many unanswered probes
+#define MTU_PROBE_TIMEOUT   1.    // seconds to wait for each probe
+#define MTU_PROBE_STEP      8     // stop searching when the interval gets this small
+#define MTU_REPROBE         600.  // search again this often, paths change
+
+// the largest ip packet that fits into the tunnel over a path with the given mtu
+int tunnel_mtu (int path_mtu);
+
 struct connection
 {
   conf_node *conf;
@@ -155,6 +280,7 @@ struct connection
 
   tstamp last_activity;	// time of last packet received
   tstamp last_establish_attempt;
+  tstamp hold_until;	// ondemand connections keep trying until then, even with empty queues
   //tstamp last_si_change; // time we last changed the socket address
 
   u32 oseqno;
@@ -164,6 +290,50 @@ struct connection
   u8 features;
   bool is_direct; // current connection (si) is direct?
 
+  tstamp ping_sent; // when we sent the last unanswered ping, or 0
+  u32 ping_nonce;   // ...and the stamp it carried
+  double rtt;       // smoothed round-trip time, 0 == unknown
+  u16 ls_cost;      // the link cost last used for routing, 0 == none yet
+
+  // every path (protocol and address) the peer can be reached over, si
+  // is one of them. we probe them all, and use the best (or, in multipath
+  // mode, all of them)
+  struct path
+  {
+    sockinfo si;
+    tstamp last_rx;   // last authenticated packet or pong over it, 0 == not validated
+    tstamp ping_sent; // unanswered probe, or 0
+    u32 ping_nonce;   // ...and the stamp it carried
+    double rtt, loss; // smoothed
+  };
+
+  vector<path> paths;
+  u8 switch_votes; // consecutive probes that found a clearly better path
+
+  path *find_path (const sockinfo &si);
+  bool path_seen (const sockinfo &si);
+  bool path_alive (const path &p) const;
+  double path_cost (const path &p) const;
+  void add_path (const sockinfo &si);
+  const sockinfo &path_si (u32 hash);
+  const sockinfo &data_si (u32 hash);
+  void probe_cb (ev::timer &w, int revents); ev::timer probe;
+
+  // path mtu discovery: a binary search with padded pings that must
+  // not be fragmented. the tunnel itself lets the kernel fragment, so
+  // the result is only used to clamp the mss of tcp connections.
+  u16 mtu;                 // the largest outer packet known to get through
+  u16 mtu_lo, mtu_hi;      // the search interval, mtu_lo works
+  u16 mtu_probe;           // size of the outstanding probe, 0 == none
+  u32 mtu_stamp;           // ...and the ping stamp it was sent with
+  u8 mtu_tries;
+
+  void mtu_start ();
+  void send_mtu_probe ();
+  void mtu_cb (ev::timer &w, int revents); ev::timer mtu_timer;
+
+  void prewarm_tcp ();
+
   pkt_queue data_queue, vpn_queue;
 
   crypto_ctx *octx, *ictx;
@@ -191,15 +361,18 @@ struct connection
   void send_auth_response (const sockinfo &si, const rsaid &id, const rsachallenge &chg);
   void send_connect_info (int rid, const sockinfo &rsi, u8 rprotocols);
   void send_reset (const sockinfo &dsi);
-  void send_ping (const sockinfo &dsi, u8 pong = 0);
+  void send_ping (const sockinfo &dsi, u8 pong = 0, u32 stamp = 0); // stamp: echoed in pongs
+  void send_linkstate (const linkstate_packet *pkt);
   void send_data_packet (tap_packet *pkt);
+  // send pkt to all of the given, established, connections
+  static void send_data_broadcast (tap_packet *pkt, vector<connection *> &conns);
 
   void post_inject_queue ();
   void inject_data_packet (tap_packet *pkt);
   void inject_vpn_packet (vpn_packet *pkt, int tos = 0); /* for forwarding */
 
   void recv_vpn_packet (vpn_packet *pkt, const sockinfo &rsi);
-  void send_vpn_packet (vpn_packet *pkt, const sockinfo &si, int tos = 0);
+  void send_vpn_packet (vpn_packet *pkt, const sockinfo &si, int tos = 0, int prio = -1); // prio < 0: derive from tos
 
   void script_init_env (const char *ext);
   void script_init_connect_env ();
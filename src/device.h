@@ -39,9 +39,37 @@
 #include "global.h"
 #include "util.h"
 
+// send priority bands, highest priority first, see pkt_queue
+enum { PRIO_INTERACTIVE, PRIO_NORMAL, PRIO_BULK, PRIO_BANDS };
+
+// map an ipv4 tos byte (dscp or old-style tos bits) to a priority band
+int tos_prio (int tos);
+
 struct net_packet
 {
-  u32 len; // actually u16, but padding...
+  u16 len;
+  u16 refcnt; // number of additional references, see ref ()/unref ()
+  u8 src2, dst2; // node id bits 12..19 of extended vpn packets, not part of the data
+  u16 flow;      // hash of the inner flow for data packets, not part of the data
+                 // (the header must stay a multiple of four bytes, see hmac_gen)
+
+  // packets that need to be kept around in more than one place (queued
+  // broadcasts, forwarded packets) are shared instead of copied. whoever
+  // takes a reference must release it with unref (), the last unref ()
+  // frees the packet. a freshly allocated packet has exactly one owner.
+  net_packet *ref ()
+    {
+      ++refcnt;
+      return this;
+    }
+
+  void unref ()
+    {
+      if (refcnt)
+        --refcnt;
+      else
+        delete this;
+    }
 
   u8 &operator[] (u16 offset) const;
   u8 *at (u16 offset) const;
@@ -65,7 +93,10 @@ struct net_packet
 
   void set (const net_packet &pkt)
     {
-      len = pkt.len;
+      len  = pkt.len;
+      src2 = pkt.src2;
+      dst2 = pkt.dst2;
+      flow = pkt.flow;
       memcpy (&((*this)[0]), &(pkt[0]), len);
     }
 
@@ -85,6 +116,19 @@ struct net_packet
       return *(u32 *)&(*this)[30];
     }
 
+  // hash over the ip flow (addresses, protocol and ports) of an
+  // ethernet frame, used to tell flows apart in queues
+  u32 flow_hash () const;
+
+  // lower the mss option of an ipv4 tcp syn to at most mss
+  void clamp_mss (int mss);
+
+  // the priority band of an ethernet frame, by its tos/dscp
+  int prio () const
+    {
+      return is_ipv4 () ? tos_prio ((*this)[15]) : PRIO_NORMAL;
+    }
+
   bool is_arp () const
     {
       return (*this)[12] == 0x08 && (*this)[13] == 0x06		// 0806 protocol
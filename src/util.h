@@ -73,7 +73,7 @@ typedef u8 mac[6];
 
 extern void id2mac (unsigned int id, void *m);
 
-#define mac2id(p) ((p)[0] & 0x01 ? 0 : ((p)[4] << 8) | (p)[5])
+#define mac2id(p) ((p)[0] & 0x01 ? 0 : ((p)[3] << 16) | ((p)[4] << 8) | (p)[5])
 
 struct sliding_window
 {
@@ -158,5 +158,12 @@ rsa_decrypt (RSA *key, const rsacrypt &encr, rsaclear &chg)
 // only one work_cb will execute at any one time.
 void async (callback<void ()> work_cb, callback<void ()> done_cb);
 
+// call work_cb (0) .. work_cb (count - 1), spread over a small pool of
+// worker threads (the calling thread helps), and return when all calls
+// have finished. work_cb must not touch any shared state (this includes
+// allocating packets and logging). without thread support, this simply
+// runs all calls in the calling thread.
+void parallel_for (int count, callback<void (int)> work_cb);
+
 #endif
 
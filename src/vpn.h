@@ -37,10 +37,13 @@
 #include "device.h"
 #include "connection.h"
 
+#define DNS_SNDID_BITS 8 // outstanding dns requests are hashed by this many id bits
+
 struct vpn
 {
   int udpv4_fd , tcpv4_fd, ipv4_fd , icmpv4_fd , dnsv4_fd;
   int udpv4_tos,           ipv4_tos, icmpv4_tos, dnsv4_tos;
+  int udpv4_prio,          ipv4_prio, icmpv4_prio;
 
   int events;
 
@@ -56,50 +59,138 @@ struct vpn
   typedef vector<connection *> conns_vector;
   conns_vector conns;
 
+  // the connection to the node with the given id, or 0 if there is none
+  connection *find_conn (unsigned int id) const
+  {
+    return id - 1 < conns.size () ? conns[id - 1] : 0;
+  }
+
+  // established connections to nodes with routerprio > 1, ordered by
+  // descending priority and node id, see router_update
+  conns_vector routers;
+
   // called when any conenction has been established
   void connection_established (connection *c);
+  // called whenever a connection gains or loses its crypto contexts
+  void router_update (connection *c);
 
   // return true if src can connect directly to dst
   bool can_direct (conf_node *src, conf_node *dst) const;
   connection *find_router_for (const connection *dst);
 
+  // link-state routing: routers flood the list of their direct links,
+  // and every node computes the first hop of the cheapest multi-hop
+  // path to every other node from that whenever it changes.
+  struct linkstate
+  {
+    u32 seqno;
+    tstamp expire;
+    vector<u32> links; // (node id << 16) | cost, 0 == not yet received
+    vector<bool> seen; // chunks of seqno already received, by offset / LINKSTATE_MAX_LINKS
+
+    linkstate () : seqno (0), expire (0.) { }
+  };
+
+  vector<linkstate> lsdb;        // indexed by node id - 1
+  vector<connection *> next_hop; // indexed by node id - 1, 0 == no route
+  u32 ls_seqno;
+
+  void linkstate_changed ();          // our own links changed
+  void linkstate_rtt (connection *c); // c has a new rtt estimate
+  void linkstate_recv (connection *c, linkstate_packet *p);
+  void linkstate_flood (const linkstate_packet *p, connection *except);
+  void linkstate_send ();
+  void linkstate_cb (ev::timer &w, int revents); ev::timer linkstate_refresh, linkstate_soon;
+  void route_cb (ev::timer &w, int revents); ev::timer route_update;
+
   void reconnect_all ();
+  void reload_config ();
   void shutdown_all ();
 
+  // the configuration overrides from the command line, for reload_config
+  int conf_argc;
+  char **conf_argv;
+
   void tap_ev (ev::io &w, int revents); ev::io tap_ev_watcher;
   void inject_data_packet (tap_packet *pkt, int dst);
 
   void send_connect_request (connection *c);
 
-  void recv_vpn_packet (vpn_packet *pkt, const sockinfo &rsi);
-  bool send_vpn_packet (vpn_packet *pkt, const sockinfo &si, int tos = 0);
+  void recv_vpn_packet (vpn_packet *pkt, const sockinfo &rsi, int tos = 0); // tos: of the outer ip header, if known
+  bool send_vpn_packet (vpn_packet *pkt, const sockinfo &si, int tos = 0, int prio = PRIO_NORMAL);
+  bool send_probe_packet (vpn_packet *pkt, const sockinfo &si);
+
+  // routers forward packets for other nodes as received, keeping the
+  // outer tos. relays from udp to udp are collected while a burst of
+  // packets is read, and then sent in one go per next hop and tos.
+  struct relay_entry
+  {
+    vpn_packet *pkt; // one reference
+    unsigned int id; // of the next hop, resolved only when flushing
+    connection *c;   // ...to this
+    int tos;
+  };
+
+  vector<relay_entry> relay_batch;
+
+  struct
+  {
+    unsigned long packets, bytes; // relayed in total
+    unsigned long queued;         // ...of which had to wait for the next hop
+    unsigned long batches;        // batched sends
+  } relay_stats;
+
+  void relay_vpn_packet (vpn_packet *pkt, connection *c, const sockinfo &rsi, int tos);
+  void relay_flush ();
 
 #if ENABLE_TCP
   void tcpv4_ev (ev::io &w, int revents); ev::io tcpv4_ev_watcher;
-  bool send_tcpv4_packet (vpn_packet *pkt, const sockinfo &si, int tos);
+  bool send_tcpv4_packet (vpn_packet *pkt, const sockinfo &si, int tos, int prio);
+  void tcpv4_dump_status ();
+  bool tcpv4_prewarm (const sockinfo &si);
+  bool tcpv4_established (const sockinfo &si);
 #endif
 
 #if ENABLE_ICMP
   void icmpv4_ev (ev::io &w, int revents); ev::io icmpv4_ev_watcher;
-  bool send_icmpv4_packet (vpn_packet *pkt, const sockinfo &si, int tos);
+  bool send_icmpv4_packet (vpn_packet *pkt, const sockinfo &si, int tos, int prio);
 #endif
 
 #if ENABLE_DNS
   vector<struct dns_snd *> dns_sndpq;
-  sockinfo dns_forwarder;
+  struct dns_snd *dns_sndid [1 << DNS_SNDID_BITS]; // dns_sndpq, hashed by dns id
+
+  // the resolvers the dns client spreads its requests over
+  struct dns_forwarder
+  {
+    sockinfo si;
+    double srtt, min_rtt; // reply latency, 0 == not yet measured
+    double loss;          // smoothed fraction of requests timing out
+    int outstanding;
+    int timeouts;         // in a row
+    tstamp quarantine;    // gets no requests before this, if avoidable
+    unsigned long sent, replies;
+
+    dns_forwarder ()
+    : srtt (0.), min_rtt (0.), loss (0.), outstanding (0), timeouts (0), quarantine (0.), sent (0), replies (0)
+    { }
+  };
+
+  vector<dns_forwarder> dns_forwarders;
 
   void dnsv4_ev (ev::io &w, int revents); ev::io dnsv4_ev_watcher;
   void dnsv4_server (struct dns_packet &pkt);
   void dnsv4_client (struct dns_packet &pkt);
+  void dnsv4_dump_status ();
 
-  bool send_dnsv4_packet (vpn_packet *pkt, const sockinfo &si, int tos);
+  bool send_dnsv4_packet (vpn_packet *pkt, const sockinfo &si, int tos, int prio);
 #endif
 
   void udpv4_ev (ev::io &w, int revents); ev::io udpv4_ev_watcher;
-  bool send_udpv4_packet (vpn_packet *pkt, const sockinfo &si, int tos);
+  bool send_udpv4_packet (vpn_packet *pkt, const sockinfo &si, int tos, int prio);
 
   void ipv4_ev (ev::io &w, int revents); ev::io ipv4_ev_watcher;
-  bool send_ipv4_packet (vpn_packet *pkt, const sockinfo &si, int tos);
+  bool send_ipv4_packet (vpn_packet *pkt, const sockinfo &si, int tos, int prio);
 
   vpn ();
   ~vpn ();